@@ -31,6 +31,8 @@
 #include <string>
 #include <vector>
 #include <set>
+#include <map>
+#include <unordered_map>
 
 #include	"function.h"
 #include "externs.h"
@@ -172,6 +174,8 @@ class DLLExportClass {
 		static void Set_Content_Directory(const char *dir);
 
 		static bool Get_Layer_State(uint64 player_id, unsigned char *buffer_in, unsigned int buffer_size);
+		static bool Get_Layer_Delta_State(uint64 player_id, unsigned char *buffer_in, unsigned int buffer_size);
+		static void Reset_Layer_Delta(void);
 		static bool Get_Sidebar_State(uint64 player_id, unsigned char *buffer_in, unsigned int buffer_size);
 		static bool Start_Construction(uint64 player_id, int buildable_type, int buildable_id);
 		static bool Hold_Construction(uint64 player_id, int buildable_type, int buildable_id);
@@ -211,8 +215,10 @@ class DLLExportClass {
 		static void Cell_Class_Draw_It(CNCDynamicMapStruct *dynamic_map, int &entry_index, CellClass *cell_ptr, int xpixel, int ypixel, bool debug_output);
 		static bool Get_Dynamic_Map_State(uint64 player_id, unsigned char *buffer_in, unsigned int buffer_size);
 		static bool Get_Shroud_State(uint64 player_id, unsigned char *buffer_in, unsigned int buffer_size);
+		static bool Get_Shroud_Packed_State(uint64 player_id, unsigned char *buffer_in, unsigned int buffer_size);
 		static bool Get_Occupier_State(uint64 player_id, unsigned char *buffer_in, unsigned int buffer_size);
 		static bool Get_Player_Info_State(uint64 player_id, unsigned char *buffer_in, unsigned int buffer_size);
+		static bool Get_Broadcast_State(GameStateRequestEnum state_type, uint64 player_id, unsigned char *buffer_in, unsigned int buffer_size, bool &too_small);
 
 
 		static void Set_Event_Callback(CNC_Event_Callback_Type event_callback) {EventCallback = event_callback;}
@@ -298,11 +304,36 @@ class DLLExportClass {
 
 		static void Calculate_Placement_Distances(BuildingTypeClass* placement_type, unsigned char* placement_distance);
 
+		static bool Is_Layer_Object_Exported(ObjectClass *object);
+		static void Draw_Layer_Object(ObjectClass *object);
+		static unsigned long Layer_Object_Signature(ObjectClass *object);
+
 		static int CurrentDrawCount;
 		static int TotalObjectCount;
 		static int SortOrder;
 		static CNCObjectListStruct *ObjectList;
 
+		/*
+		** What each object exported in the previous layer delta, so unchanged objects don't need drawing again
+		*/
+		struct LayerCacheStruct {
+			int ID;										// Object the draws were made for, since a heap slot can be reused
+			RTTIType RTTI;
+			unsigned long Signature;				// Render state the draws were made from
+			unsigned int Sequence;					// Last delta the object was exported in
+			int SortBase;								// First sort order used by the draws
+			int SortSpan;								// Sort orders used up by the draws
+			std::vector<CNCObjectStruct> Draws;
+		};
+		struct LayerDeltaStruct {
+			std::unordered_map<const void *, LayerCacheStruct> Cache;
+			unsigned int Sequence;					// Last delta returned, 0 if none
+			long Frame;								// Game frame of the last delta
+		};
+		static std::map<uint64, LayerDeltaStruct> LayerDeltaStates;		// Per player, since the draws depend on the player context
+		static std::vector<unsigned char> LayerScratch;
+		static std::vector<CNCObjectDeltaStruct> LayerDeltas;
+
 		static CNC_Event_Callback_Type EventCallback;
 
 
@@ -310,6 +341,8 @@ class DLLExportClass {
 
 		static bool GameOver;
 
+		static bool StateTooSmall;			// Set when a state fetch fails because the buffer was too small
+
 		static std::set<int64> MessagesSent;
 
 		/*
@@ -346,6 +379,9 @@ int DLLExportClass::CurrentDrawCount = 0;
 int DLLExportClass::TotalObjectCount = 0;
 int DLLExportClass::SortOrder = 0;
 CNCObjectListStruct *DLLExportClass::ObjectList = NULL;
+std::map<uint64, DLLExportClass::LayerDeltaStruct> DLLExportClass::LayerDeltaStates;
+std::vector<unsigned char> DLLExportClass::LayerScratch;
+std::vector<CNCObjectDeltaStruct> DLLExportClass::LayerDeltas;
 SidebarGlyphxClass DLLExportClass::MultiplayerSidebars [MAX_PLAYERS];
 uint64 DLLExportClass::GlyphxPlayerIDs[MAX_PLAYERS] = {0xffffffffl};
 int DLLExportClass::CurrentLocalPlayerIndex = -1;
@@ -356,6 +392,7 @@ unsigned char DLLExportClass::SpecialKeyFlags[MAX_PLAYERS] = { 0U };
 DynamicVectorClass<char *> DLLExportClass::ModSearchPaths;
 std::set<int64> DLLExportClass::MessagesSent;
 bool DLLExportClass::GameOver = false;
+bool DLLExportClass::StateTooSmall = false;
 
 
 
@@ -444,6 +481,11 @@ void On_Achievement_Event(const HouseClass* player_ptr, const char *achievement_
 	DLLExportClass::On_Achievement(player_ptr, achievement_type, achievement_reason);
 }			  
 
+bool Broadcast_Game_State(GameStateRequestEnum state_type, uint64 player_id, unsigned char *buffer_in, unsigned int buffer_size, bool &too_small)
+{
+	return DLLExportClass::Get_Broadcast_State(state_type, player_id, buffer_in, buffer_size, too_small);
+}
+
 
 
 
@@ -1164,6 +1206,7 @@ extern "C" __declspec(dllexport) bool __cdecl CNC_Start_Instance_Variation(int s
 
 	DLLExportClass::Reset_Sidebars();
 	DLLExportClass::Reset_Player_Context();
+	DLLExportClass::Reset_Layer_Delta();
 	DLLExportClass::Calculate_Start_Positions();
 
 	/*
@@ -1395,6 +1438,7 @@ extern "C" __declspec(dllexport) bool __cdecl CNC_Start_Custom_Instance(const ch
 
 	DLLExportClass::Reset_Sidebars();
 	DLLExportClass::Reset_Player_Context();
+	DLLExportClass::Reset_Layer_Delta();
 	DLLExportClass::Calculate_Start_Positions();
 
 	/*
@@ -1654,6 +1698,12 @@ extern "C" __declspec(dllexport) bool __cdecl CNC_Advance_Instance(uint64 player
 		}
 	}
 
+	/*
+	**	Send this frame's state to any spectators.
+	*/
+	BroadcastServer.AI();
+	Counters.AI();
+
 	/*
 	**	Keep track of elapsed time in the game.
 	*/
@@ -2913,6 +2963,12 @@ extern "C" __declspec(dllexport) bool __cdecl CNC_Get_Game_State(GameStateReques
 			break;
 		}		 
 
+		case GAME_STATE_LAYERS_DELTA:
+		{
+			got_state = DLLExportClass::Get_Layer_Delta_State(player_id, buffer_in, buffer_size);
+			break;
+		}
+
 		case GAME_STATE_SIDEBAR:
 		{	
 			got_state = DLLExportClass::Get_Sidebar_State(player_id, buffer_in, buffer_size);
@@ -2933,6 +2989,10 @@ extern "C" __declspec(dllexport) bool __cdecl CNC_Get_Game_State(GameStateReques
 			got_state = DLLExportClass::Get_Shroud_State(player_id, buffer_in, buffer_size);
 			break;
 
+		case GAME_STATE_SHROUD_PACKED:
+			got_state = DLLExportClass::Get_Shroud_Packed_State(player_id, buffer_in, buffer_size);
+			break;
+
 		case GAME_STATE_OCCUPIER:
 			got_state = DLLExportClass::Get_Occupier_State(player_id, buffer_in, buffer_size);
 			break;
@@ -3030,6 +3090,60 @@ extern "C" __declspec(dllexport) bool __cdecl CNC_Get_Game_State(GameStateReques
 }
 
 
+/**************************************************************************************************
+* DLLExportClass::Get_Broadcast_State -- Get game state for the state broadcast server
+*
+* In:   Type of state requested
+*       Player perspective
+*       Buffer to contain game state
+*       Size of buffer
+*       Set if the state didn't fit in the buffer
+*
+* Out:  Game state returned in buffer
+*
+* The broadcast server also runs outside of GlyphX, where the GlyphX player IDs aren't set up. A state that
+* switches the player context is only fetched for a player ID that is known, and the player that was in
+* context before is put back afterwards so that fetching never changes PlayerPtr under the game.
+*
+**************************************************************************************************/
+bool DLLExportClass::Get_Broadcast_State(GameStateRequestEnum state_type, uint64 player_id, unsigned char *buffer_in, unsigned int buffer_size, bool &too_small)
+{
+	too_small = false;
+
+	if (GAME_TO_PLAY != GAME_NORMAL && (state_type == GAME_STATE_PLAYER_INFO || state_type == GAME_STATE_SHROUD_PACKED)) {
+		bool known = false;
+		if (RunningAsDLL) {
+			for (int i=0 ; i<MULTIPLAYER_COUNT ; i++) {
+				if (GlyphxPlayerIDs[i] == player_id) {
+					known = true;
+				}
+			}
+		}
+		if (!known) {
+			return false;
+		}
+	}
+
+	HouseClass *player_ptr = PlayerPtr;
+	int player_index = CurrentLocalPlayerIndex;
+
+	StateTooSmall = false;
+	bool got_state = CNC_Get_Game_State(state_type, player_id, buffer_in, buffer_size);
+	too_small = !got_state && StateTooSmall;
+
+	if (PlayerPtr != player_ptr || CurrentLocalPlayerIndex != player_index) {
+		PlayerPtr = player_ptr;
+		CurrentLocalPlayerIndex = player_index;
+		if (PlayerPtr) {
+			CurrentObject.Set_Active_Context(PlayerPtr->Class->House);
+		}
+		Refresh_Player_Control_Flags();
+	}
+
+	return got_state;
+}
+
+
 /**************************************************************************************************
 * CNC_Handle_Game_Request
 *
@@ -3449,6 +3563,127 @@ void DLLExportClass::DLL_Draw_Pip_Intercept(const ObjectClass* object, int pip)
 
 
 
+/**************************************************************************************************
+* DLLExportClass::Is_Layer_Object_Exported -- Should this layer object be exported?
+*
+* In:   Object in one of the map layers
+*
+* Out:  True if the object is drawn into the layer state
+*
+**************************************************************************************************/
+bool DLLExportClass::Is_Layer_Object_Exported(ObjectClass *object)
+{
+	if (!object->IsActive) {
+		return false;
+	}
+
+	if (object->Is_Techno()) {
+		/*
+		**  Skip units tethered to buildings, since the building will draw them itself
+		*/
+		TechnoClass* techno_object = static_cast<TechnoClass*>(object);
+		TechnoClass* contact_object = techno_object->In_Radio_Contact() ? techno_object->Contact_With_Whom() : nullptr;
+		if ((object->What_Am_I() != RTTI_BUILDING) && (contact_object != nullptr) && (contact_object->What_Am_I() == RTTI_BUILDING) && contact_object->IsTethered && *((BuildingClass*)contact_object) == STRUCT_WEAP) {
+			return false;
+		}
+
+		/*
+		**  Skip units tethered to vessels, since the vessel will draw them itself
+		*/
+		if ((contact_object != nullptr) && (contact_object->What_Am_I() == RTTI_VESSEL) && !contact_object->Is_Door_Closed() && contact_object->IsTethered && !techno_object->IsInLimbo) {
+			return false;
+		}
+	}
+
+	return Debug_Map || Debug_Unshroud || (object->IsDown && !object->IsInLimbo);
+}
+
+
+/**************************************************************************************************
+* DLLExportClass::Draw_Layer_Object -- Draw a layer object into the object list
+*
+* In:   Object to draw. The draws are added at TotalObjectCount
+*
+* Out:  
+*
+**************************************************************************************************/
+void DLLExportClass::Draw_Layer_Object(ObjectClass *object)
+{
+	int	x, y;
+	Map.Coord_To_Pixel(object->Render_Coord(), x, y);
+	
+	/*
+	** Call to Draw_It can result in multiple callbacks to the draw intercept
+	*/
+	CurrentDrawCount = 0;
+	object->Draw_It(x, y, WINDOW_VIRTUAL);
+
+	/*
+	** If the root object is a factory, then the last base object is the object in production (rendered after infiltrated buildings when selected).
+	** The root object is updated with the production asset name, but otherwise a separate object isn't created.
+	** This only occurs in skirmish and multiplayer.
+	*/
+	if ((GAME_TO_PLAY != GAME_NORMAL) && (CurrentDrawCount > 0)) {
+		CNCObjectStruct& root_object = ObjectList->Objects[TotalObjectCount];
+		if (root_object.IsFactory) {
+			BuildingClass* building = (BuildingClass*)root_object.CNCInternalObjectPointer;
+			FactoryClass* factory = building->House->IsHuman ? building->House->Fetch_Factory(building->Class->ToBuild) : building->Factory;
+			if (factory != nullptr) {
+				for (int i = CurrentDrawCount - 1; i > 0; --i) {
+					CNCObjectStruct& base_object = ObjectList->Objects[TotalObjectCount + i];
+					if (base_object.SubObject) {
+						continue;
+					}
+					strncpy(root_object.ProductionAssetName, base_object.TypeName, CNC_OBJECT_ASSET_NAME_LENGTH);
+					void* production_object = base_object.CNCInternalObjectPointer;
+					int new_draw_count = i;
+					for (int j = i + 1; j < CurrentDrawCount; ++j) {
+						CNCObjectStruct& cnc_object = ObjectList->Objects[TotalObjectCount + j];
+						if (cnc_object.CNCInternalObjectPointer != production_object) {
+							memcpy(ObjectList->Objects + TotalObjectCount + new_draw_count, &cnc_object, sizeof(CNCObjectStruct));
+							new_draw_count++;
+						}
+					}
+					memset(ObjectList->Objects + TotalObjectCount + new_draw_count, 0, (CurrentDrawCount - new_draw_count) * sizeof(CNCObjectStruct));
+					CurrentDrawCount = new_draw_count;
+					break;
+				}
+			}
+		}
+	}
+
+	/*
+	** Shadows need to be rendered before the base object so they appear underneath,
+	** even though they get drawn as sub-objects (after the base object)
+	*/
+	for (int i = 1; i < CurrentDrawCount; ++i) {
+		CNCObjectStruct& sub_object = ObjectList->Objects[TotalObjectCount + i];
+		if (!sub_object.SubObject) {
+			continue;
+		}
+		static const int shadow_flags = SHAPE_PREDATOR | SHAPE_FADING;
+		if (((sub_object.DrawFlags & shadow_flags) == shadow_flags) || (strncmp(sub_object.AssetName, "WAKE", CNC_OBJECT_ASSET_NAME_LENGTH) == 0)) {
+			if ((strncmp(sub_object.AssetName, "RROTOR", CNC_OBJECT_ASSET_NAME_LENGTH) != 0) &&
+				(strncmp(sub_object.AssetName, "LROTOR", CNC_OBJECT_ASSET_NAME_LENGTH) != 0)) {
+				for (int j = i - 1; j >= 0; --j) {
+					CNCObjectStruct& base_object = ObjectList->Objects[TotalObjectCount + j];
+					if (!base_object.SubObject && (base_object.CNCInternalObjectPointer == sub_object.CNCInternalObjectPointer)) {
+						int sort_order = base_object.SortOrder;
+						base_object.SortOrder = sub_object.SortOrder;
+						sub_object.SortOrder = sort_order;
+						break;
+					}
+				}
+			}
+		}
+	}
+
+	TotalObjectCount += CurrentDrawCount;
+}
+
+
+
+
 /**************************************************************************************************
 * DLLExportClass::Get_Layer_State -- Get game objects from the layers
 *
@@ -3499,111 +3734,313 @@ bool DLLExportClass::Get_Layer_State(uint64 player_id, unsigned char *buffer_in,
 				unsigned int memory_needed = sizeof(CNCObjectListStruct);
 				memory_needed += (TotalObjectCount + 10) * sizeof(CNCObjectStruct);
 				if (memory_needed >= buffer_size) {
+					StateTooSmall = true;
 					return false;
 				}
 				
-				if (object->Is_Techno()) {
-					/*
-					**  Skip units tethered to buildings, since the building will draw them itself
-					*/
-					TechnoClass* techno_object = static_cast<TechnoClass*>(object);
-					TechnoClass* contact_object = techno_object->In_Radio_Contact() ? techno_object->Contact_With_Whom() : nullptr;
-					if ((object->What_Am_I() != RTTI_BUILDING) && (contact_object != nullptr) && (contact_object->What_Am_I() == RTTI_BUILDING) && contact_object->IsTethered && *((BuildingClass*)contact_object) == STRUCT_WEAP) {
-						continue;
-					}
-
-					/*
-					**  Skip units tethered to vessels, since the vessel will draw them itself
-					*/
-					if ((contact_object != nullptr) && (contact_object->What_Am_I() == RTTI_VESSEL) && !contact_object->Is_Door_Closed() && contact_object->IsTethered && !techno_object->IsInLimbo) {
-						continue;
-					}
+				if (Is_Layer_Object_Exported(object)) {
+					Draw_Layer_Object(object);
 				}
+			}
+		}
+	}
 
-				if (Debug_Map || Debug_Unshroud || (object->IsDown && !object->IsInLimbo)) {
-					int	x, y;
-					Map.Coord_To_Pixel(object->Render_Coord(), x, y);
-					
-					/*
-					** Call to Draw_It can result in multiple callbacks to the draw intercept
-					*/
-					CurrentDrawCount = 0;
-					object->Draw_It(x, y, WINDOW_VIRTUAL);
+	ObjectList->Count = TotalObjectCount;
 
-					/*
-					** If the root object is a factory, then the last base object is the object in production (rendered after infiltrated buildings when selected).
-					** The root object is updated with the production asset name, but otherwise a separate object isn't created.
-					** This only occurs in skirmish and multiplayer.
-					*/
-					if ((GAME_TO_PLAY != GAME_NORMAL) && (CurrentDrawCount > 0)) {
-						CNCObjectStruct& root_object = ObjectList->Objects[TotalObjectCount];
-						if (root_object.IsFactory) {
-							BuildingClass* building = (BuildingClass*)root_object.CNCInternalObjectPointer;
-							FactoryClass* factory = building->House->IsHuman ? building->House->Fetch_Factory(building->Class->ToBuild) : building->Factory;
-							if (factory != nullptr) {
-								for (int i = CurrentDrawCount - 1; i > 0; --i) {
-									CNCObjectStruct& base_object = ObjectList->Objects[TotalObjectCount + i];
-									if (base_object.SubObject) {
-										continue;
-									}
-									strncpy(root_object.ProductionAssetName, base_object.TypeName, CNC_OBJECT_ASSET_NAME_LENGTH);
-									void* production_object = base_object.CNCInternalObjectPointer;
-									int new_draw_count = i;
-									for (int j = i + 1; j < CurrentDrawCount; ++j) {
-										CNCObjectStruct& cnc_object = ObjectList->Objects[TotalObjectCount + j];
-										if (cnc_object.CNCInternalObjectPointer != production_object) {
-											memcpy(ObjectList->Objects + TotalObjectCount + new_draw_count, &cnc_object, sizeof(CNCObjectStruct));
-											new_draw_count++;
-										}
-									}
-									memset(ObjectList->Objects + TotalObjectCount + new_draw_count, 0, (CurrentDrawCount - new_draw_count) * sizeof(CNCObjectStruct));
-									CurrentDrawCount = new_draw_count;
-									break;
-								}
-							}
-						}
-					}
+	if (ObjectList->Count) {
+		_export_count++;
+		return true;
+	}
 
-					/*
-					** Shadows need to be rendered before the base object so they appear underneath,
-					** even though they get drawn as sub-objects (after the base object)
-					*/
-					for (int i = 1; i < CurrentDrawCount; ++i) {
-						CNCObjectStruct& sub_object = ObjectList->Objects[TotalObjectCount + i];
-						if (!sub_object.SubObject) {
+	return false;
+}
+
+
+
+
+/**************************************************************************************************
+* DLLExportClass::Layer_Object_Signature -- Sum up the state a layer object is drawn from
+*
+* In:   Object to look at
+*
+* Out:  Signature that changes whenever the draws of the object could change. 0 if the object
+*       must always be drawn again
+*
+**************************************************************************************************/
+unsigned long DLLExportClass::Layer_Object_Signature(ObjectClass *object)
+{
+	RTTIType rtti = object->What_Am_I();
+	if (rtti == RTTI_ANIM || rtti == RTTI_BULLET || rtti == RTTI_AIRCRAFT) {
+		return 0;
+	}
+
+	unsigned long signature = 0;
+	Add_CRC(&signature, (unsigned long)(intptr_t)&object->Class_Of());
+	Add_CRC(&signature, (unsigned long)object->Render_Coord());
+	Add_CRC(&signature, (unsigned long)object->Strength);
+	Add_CRC(&signature, (unsigned long)object->IsSelectedMask);
+	Add_CRC(&signature, (unsigned long)object->Owner());
+	Add_CRC(&signature, (unsigned long)(intptr_t)PlayerPtr);
+
+	/*
+	** Who is allied with whom decides the visibility flags, and the shroud decides what the player sees
+	*/
+	HouseClass *owner = HouseClass::As_Pointer(object->Owner());
+	if (owner != nullptr) {
+		Add_CRC(&signature, (unsigned long)owner->Allies);
+	}
+	Add_CRC(&signature, (unsigned long)PlayerPtr->Allies);
+	CellClass const &cell = Map[Coord_Cell(object->Center_Coord())];
+	Add_CRC(&signature, (unsigned long)((cell.Is_Mapped(PlayerPtr) ? 1 : 0) | (cell.Is_Visible(PlayerPtr) ? 2 : 0)));
+
+	if (rtti == RTTI_TERRAIN) {
+		Add_CRC(&signature, (unsigned long)((TerrainClass *)object)->Fetch_Stage());
+	}
+
+	if (object->Is_Techno()) {
+		TechnoClass * techno = (TechnoClass *)object;
+		Add_CRC(&signature, (unsigned long)techno->Fetch_Stage());
+		Add_CRC(&signature, (unsigned long)techno->PrimaryFacing.Current());
+		Add_CRC(&signature, (unsigned long)techno->Cloak);
+		Add_CRC(&signature, (unsigned long)techno->Spied_By());
+		Add_CRC(&signature, (unsigned long)techno->CloakingDevice.Fetch_Stage());
+		Add_CRC(&signature, (unsigned long)techno->Get_Flashing_Flags());
+		Add_CRC(&signature, (unsigned long)techno->Ammo);
+		Add_CRC(&signature, (unsigned long)techno->How_Many());
+		Add_CRC(&signature, (unsigned long)(techno->IronCurtainCountDown > 0));
+
+		switch (rtti) {
+			case RTTI_UNIT:
+				Add_CRC(&signature, (unsigned long)((UnitClass *)object)->SecondaryFacing.Current());
+				Add_CRC(&signature, (unsigned long)((UnitClass *)object)->Tiberium);
+				break;
+
+			case RTTI_VESSEL:
+				Add_CRC(&signature, (unsigned long)((VesselClass *)object)->SecondaryFacing.Current());
+				break;
+
+			case RTTI_INFANTRY:
+				Add_CRC(&signature, (unsigned long)((InfantryClass *)object)->Doing);
+				break;
+
+			case RTTI_BUILDING:
+				Add_CRC(&signature, (unsigned long)((BuildingClass *)object)->BState);
+				Add_CRC(&signature, (unsigned long)((BuildingClass *)object)->Factory.Is_Valid());
+				break;
+
+			default:
+				break;
+		}
+	}
+
+	return (signature != 0) ? signature : 1;
+}
+
+
+/**************************************************************************************************
+* DLLExportClass::Reset_Layer_Delta -- Start the layer deltas over
+*
+* In:   
+*
+* Out:  The next layer delta of every player holds every object, with a base sequence of 0
+*
+**************************************************************************************************/
+void DLLExportClass::Reset_Layer_Delta(void)
+{
+	LayerDeltaStates.clear();
+	LayerDeltas.clear();
+}
+
+
+/**************************************************************************************************
+* DLLExportClass::Get_Layer_Delta_State -- Get the changes to the layer objects since the last call
+*
+*    Builds the same object table as Get_Layer_State, but objects whose render state didn't change
+*    since the previous call reuse their previous draws instead of being drawn again. Every object is
+*    still drawn again every LAYER_REFRESH_FRAMES frames, staggered by ID, to pick up anything the
+*    render state signature doesn't cover. The table is then compared with the previous one, and only
+*    the entries that were added, changed, re-sorted or removed are returned.
+*
+*    Each player has its own previous table. If the buffer is too small the player's deltas start
+*    over, so the next successful call has a base sequence of 0 and holds every object.
+*
+* In:   Player the state is for
+*
+* Out:  True if the delta was written
+*
+**************************************************************************************************/
+bool DLLExportClass::Get_Layer_Delta_State(uint64 player_id, unsigned char *buffer_in, unsigned int buffer_size)
+{
+	enum {
+		LAYER_REFRESH_FRAMES = 16,			// Frames between forced redraws of an unchanged object
+		LAYER_DRAW_SLACK = 32				// Room left for the draws of one object
+	};
+
+	LayerDeltaStruct &state = LayerDeltaStates[player_id];
+	if (Frame < state.Frame) {
+		state.Cache.clear();
+		state.Sequence = 0;
+	}
+	state.Frame = Frame;
+
+	unsigned int base_sequence = state.Sequence;
+	unsigned int sequence = state.Sequence + 1;
+	if (sequence == 0) {
+		sequence = 1;
+	}
+
+	LayerDeltas.clear();
+	TotalObjectCount = 0;
+	SortOrder = 0;
+
+	int changed_count = 0;
+
+	for (int layer = 0; layer < DLL_LAYER_COUNT; layer++) {
+
+		for (int index = 0; index < Map.Layer[layer].Count(); index++) {
+
+			ObjectClass *object = Map.Layer[layer][index];
+			if (!Is_Layer_Object_Exported(object)) {
+				continue;
+			}
+
+			/*
+			** The draws are built in the scratch table, which must have room for whatever this object draws
+			*/
+			size_t scratch_needed = sizeof(CNCObjectListStruct) + (TotalObjectCount + LAYER_DRAW_SLACK) * sizeof(CNCObjectStruct);
+			if (LayerScratch.size() < scratch_needed) {
+				LayerScratch.resize(scratch_needed * 2);
+			}
+			ObjectList = (CNCObjectListStruct *)&LayerScratch[0];
+			CNCObjectStruct *draws = &ObjectList->Objects[TotalObjectCount];
+
+			/*
+			** A different object in the same heap slot can't reuse the draws, whatever its signature
+			*/
+			LayerCacheStruct &cache = state.Cache[object];
+			if (cache.Sequence != 0 && (cache.ID != object->ID || cache.RTTI != object->What_Am_I())) {
+				cache.Sequence = 0;
+			}
+
+			unsigned long signature = Layer_Object_Signature(object);
+			bool redraw = (signature == 0) || (cache.Sequence == 0) || (cache.Signature != signature) || (((Frame + object->ID) % LAYER_REFRESH_FRAMES) == 0);
+
+			int count = 0;
+			int sort_base = SortOrder;
+			if (redraw) {
+				memset(draws, 0, LAYER_DRAW_SLACK * sizeof(CNCObjectStruct));
+				Draw_Layer_Object(object);
+				count = CurrentDrawCount;
+			} else {
+				count = (int)cache.Draws.size();
+				if (count > 0) {
+					memcpy(draws, &cache.Draws[0], count * sizeof(CNCObjectStruct));
+				}
+				for (int i = 0; i < count; i++) {
+					draws[i].SortOrder = sort_base + (cache.Draws[i].SortOrder - cache.SortBase);
+				}
+				SortOrder += cache.SortSpan;
+				TotalObjectCount += count;
+			}
+
+			/*
+			** Compare with what the object exported last time
+			*/
+			int previous_count = (int)cache.Draws.size();
+			for (int i = 0; i < count || i < previous_count; i++) {
+				CNCObjectDeltaStruct delta;
+				delta.CNCInternalObjectPointer = object;
+				delta.DrawIndex = (unsigned short)i;
+				delta.ObjectIndex = -1;
+
+				if (i >= count) {
+					delta.Delta = OBJECT_DELTA_REMOVED;
+					delta.SortOrder = cache.Draws[i].SortOrder;
+				} else {
+					delta.SortOrder = draws[i].SortOrder;
+					if (i >= previous_count) {
+						delta.Delta = OBJECT_DELTA_ADDED;
+					} else {
+						int previous_sort = cache.Draws[i].SortOrder;
+						cache.Draws[i].SortOrder = draws[i].SortOrder;
+						if (memcmp(&cache.Draws[i], &draws[i], sizeof(CNCObjectStruct)) != 0) {
+							delta.Delta = OBJECT_DELTA_CHANGED;
+						} else if (previous_sort != draws[i].SortOrder) {
+							delta.Delta = OBJECT_DELTA_SORTED;
+						} else {
 							continue;
 						}
-						static const int shadow_flags = SHAPE_PREDATOR | SHAPE_FADING;
-						if (((sub_object.DrawFlags & shadow_flags) == shadow_flags) || (strncmp(sub_object.AssetName, "WAKE", CNC_OBJECT_ASSET_NAME_LENGTH) == 0)) {
-							if ((strncmp(sub_object.AssetName, "RROTOR", CNC_OBJECT_ASSET_NAME_LENGTH) != 0) &&
-								(strncmp(sub_object.AssetName, "LROTOR", CNC_OBJECT_ASSET_NAME_LENGTH) != 0)) {
-								for (int j = i - 1; j >= 0; --j) {
-									CNCObjectStruct& base_object = ObjectList->Objects[TotalObjectCount + j];
-									if (!base_object.SubObject && (base_object.CNCInternalObjectPointer == sub_object.CNCInternalObjectPointer)) {
-										int sort_order = base_object.SortOrder;
-										base_object.SortOrder = sub_object.SortOrder;
-										sub_object.SortOrder = sort_order;
-										break;
-									}
-								}
-							}
-						}
 					}
-
-					TotalObjectCount += CurrentDrawCount;
+					if (delta.Delta != OBJECT_DELTA_SORTED) {
+						delta.ObjectIndex = TotalObjectCount - count + i;
+						changed_count++;
+					}
 				}
+				LayerDeltas.push_back(delta);
 			}
+
+			cache.ID = object->ID;
+			cache.RTTI = object->What_Am_I();
+			cache.Signature = signature;
+			cache.Sequence = sequence;
+			cache.SortBase = sort_base;
+			cache.SortSpan = SortOrder - sort_base;
+			cache.Draws.assign(draws, draws + count);
 		}
 	}
 
-	ObjectList->Count = TotalObjectCount;
+	/*
+	** Anything not exported this time is gone
+	*/
+	for (std::unordered_map<const void *, LayerCacheStruct>::iterator it = state.Cache.begin(); it != state.Cache.end();) {
+		LayerCacheStruct &cache = it->second;
+		if (cache.Sequence != sequence) {
+			for (int i = 0; i < (int)cache.Draws.size(); i++) {
+				CNCObjectDeltaStruct delta;
+				delta.CNCInternalObjectPointer = (void *)it->first;
+				delta.DrawIndex = (unsigned short)i;
+				delta.Delta = OBJECT_DELTA_REMOVED;
+				delta.SortOrder = cache.Draws[i].SortOrder;
+				delta.ObjectIndex = -1;
+				LayerDeltas.push_back(delta);
+			}
+			it = state.Cache.erase(it);
+		} else {
+			++it;
+		}
+	}
 
-	if (ObjectList->Count) {
-		_export_count++;
-		return true;
+	/*
+	** Write out the added and changed objects, then the delta entries
+	*/
+	size_t memory_needed = sizeof(CNCObjectDeltaListStruct) + changed_count * sizeof(CNCObjectStruct) + LayerDeltas.size() * sizeof(CNCObjectDeltaStruct);
+	if (memory_needed > buffer_size) {
+		state.Cache.clear();
+		state.Sequence = 0;
+		return false;
 	}
 
-	return false;
+	CNCObjectDeltaListStruct *delta_list = (CNCObjectDeltaListStruct *)buffer_in;
+	delta_list->Sequence = sequence;
+	delta_list->BaseSequence = base_sequence;
+	delta_list->TotalCount = TotalObjectCount;
+	delta_list->Count = (int)LayerDeltas.size();
+	delta_list->ObjectCount = changed_count;
+
+	int object_index = 0;
+	for (int i = 0; i < (int)LayerDeltas.size(); i++) {
+		CNCObjectDeltaStruct &delta = LayerDeltas[i];
+		if (delta.ObjectIndex != -1) {
+			memcpy(&delta_list->Objects[object_index], &ObjectList->Objects[delta.ObjectIndex], sizeof(CNCObjectStruct));
+			delta.ObjectIndex = object_index++;
+		}
+	}
+	if (!LayerDeltas.empty()) {
+		memcpy(&delta_list->Objects[changed_count], &LayerDeltas[0], LayerDeltas.size() * sizeof(CNCObjectDeltaStruct));
+	}
+
+	state.Sequence = sequence;
+	return true;
 }
 
 
@@ -5822,6 +6259,7 @@ bool DLLExportClass::Get_Shroud_State(uint64 player_id, unsigned char *buffer_in
 
 			memory_needed += sizeof(CNCShroudEntryStruct);
 			if (memory_needed >= buffer_size) {
+				StateTooSmall = true;
 				return false;
 			}
 
@@ -5859,6 +6297,123 @@ bool DLLExportClass::Get_Shroud_State(uint64 player_id, unsigned char *buffer_in
 
 
 
+/**************************************************************************************************
+* DLLExportClass::Get_Shroud_Packed_State -- Get the shroud for the given player as bit-planes
+*
+* In:   
+*
+* Out:  
+*
+*
+*
+**************************************************************************************************/
+bool DLLExportClass::Get_Shroud_Packed_State(uint64 player_id, unsigned char *buffer_in, unsigned int buffer_size)
+{
+	if (!DLLExportClass::Set_Player_Context(player_id)) {
+		return false;
+	}
+
+	if (PlayerPtr == NULL || PlayerPtr->Class == NULL) {
+		return false;
+	}
+
+	CNCShroudPackedStruct *shroud = (CNCShroudPackedStruct*) buffer_in;
+
+	int map_cell_x = Map.MapCellX;
+	int map_cell_y = Map.MapCellY;
+	int map_cell_width = Map.MapCellWidth;
+	int map_cell_height = Map.MapCellHeight;
+
+	if (map_cell_x > 0) {
+		map_cell_x--;
+		map_cell_width++;
+	}
+
+	if (map_cell_width < MAP_MAX_CELL_WIDTH) {
+		map_cell_width++;
+	}
+
+	if (map_cell_y > 0) {
+		map_cell_y--;
+		map_cell_height++;
+	}
+
+	if (map_cell_height < MAP_MAX_CELL_HEIGHT) {
+		map_cell_height++;
+	}
+
+	int cell_count = map_cell_width * map_cell_height;
+	int plane_words = (cell_count + 31) / 32;
+
+	unsigned int memory_needed = sizeof(*shroud) + (plane_words * 3 * sizeof(unsigned int)) + 256;
+	if (memory_needed >= buffer_size) {
+		StateTooSmall = true;
+		return false;
+	}
+
+	shroud->CellX = map_cell_x;
+	shroud->CellY = map_cell_y;
+	shroud->CellWidth = map_cell_width;
+	shroud->CellHeight = map_cell_height;
+	shroud->PlaneWords = plane_words;
+	shroud->RunCount = 0;
+
+	unsigned long *mapped = (unsigned long *)&shroud->Planes[0];
+	unsigned long *visible = mapped + plane_words;
+	unsigned long *jamming = visible + plane_words;
+	memset(mapped, 0, plane_words * 3 * sizeof(unsigned long));
+
+	/*
+	** Each row of the map rectangle is a run of bits in the house's planes, so copy them across a word at a time.
+	*/
+	HousesType house = PlayerPtr->Class->House;
+	for (int y = 0; y < map_cell_height; y++) {
+		CELL cell = XY_Cell(map_cell_x, map_cell_y + y);
+		ShroudPlaneClass::Copy_Bits(ShroudPlanes.Mapped_Plane(house), cell, mapped, y * map_cell_width, map_cell_width);
+		ShroudPlaneClass::Copy_Bits(ShroudPlanes.Visible_Plane(house), cell, visible, y * map_cell_width, map_cell_width);
+	}
+
+	/*
+	** Jamming and the shadow pieces still come from the cells. Only fogged cells have a shadow piece, so the runs are
+	** few and long.
+	*/
+	CNCShroudRunStruct *runs = (CNCShroudRunStruct *)(jamming + plane_words);
+	CNCShroudRunStruct *run = NULL;
+	int index = 0;
+	for (int y = 0; y < map_cell_height; y++) {
+		for (int x = 0; x < map_cell_width; x++, index++) {
+			CELL cell = XY_Cell(map_cell_x + x, map_cell_y + y);
+			CellClass * cellptr = &Map[cell];
+
+			if (cellptr->Is_Jamming(PlayerPtr)) {
+				jamming[index >> 5] |= 1UL << (index & 31);
+			}
+
+			char shadow_index = -1;
+			if (ShroudPlanes.Is_Mapped(cell, house) && !ShroudPlanes.Is_Visible(cell, house)) {
+				shadow_index = (char)Map.Cell_Shadow(cell, PlayerPtr);
+			}
+
+			if (run == NULL || run->ShadowIndex != shadow_index || run->Count == 0xFFFF) {
+				memory_needed += sizeof(CNCShroudRunStruct);
+				if (memory_needed >= buffer_size) {
+					StateTooSmall = true;
+					return false;
+				}
+				run = &runs[shroud->RunCount++];
+				run->Count = 0;
+				run->ShadowIndex = shadow_index;
+			}
+			run->Count++;
+		}
+	}
+
+	return true;
+}
+
+
+
+
 /**************************************************************************************************
 * DLLExportClass::Get_Occupier_State -- Get the occupier state for this player
 *
@@ -5917,6 +6472,7 @@ bool DLLExportClass::Get_Occupier_State(uint64 player_id, unsigned char *buffer_
 
 			memory_needed += sizeof(CNCOccupierEntryHeaderStruct) + (sizeof(CNCOccupierObjectStruct) * occupier_count);
 			if (memory_needed >= buffer_size) {
+				StateTooSmall = true;
 				return false;
 			}
 
@@ -5964,6 +6520,7 @@ bool DLLExportClass::Get_Player_Info_State(uint64 player_id, unsigned char *buff
 	unsigned int memory_needed = sizeof(*player_info) + 32;  // A little extra for no reason
 
 	if (memory_needed >= buffer_size) {
+		StateTooSmall = true;
 		return false;
 	}
 	
@@ -6155,6 +6712,7 @@ bool DLLExportClass::Get_Dynamic_Map_State(uint64 player_id, unsigned char *buff
 
 			memory_needed += sizeof(CNCDynamicMapEntryStruct) * 2;
 			if (memory_needed >= buffer_size) {
+				StateTooSmall = true;
 				return false;
 			}
 
@@ -6410,15 +6968,15 @@ void DLLExportClass::Glyphx_Queue_AI(void)
 		//.....................................................................
 		//	Loop through all events
 		//.....................................................................
-		for (int j = 0; j < DoList.Count; j++) {
+		for (EventClass *event = DoList.First(Frame); event; event = DoList.Next(event, Frame)) {
 
-			if (!DoList[j].IsExecuted && (unsigned)Frame >= DoList[j].Frame) {
-				DoList[j].Execute();
+			if (!event->IsExecuted && (unsigned)Frame >= event->Frame) {
+				event->Execute();
 
 				//...............................................................
 				//	Mark this event as executed.
 				//...............................................................
-				DoList[j].IsExecuted = 1;
+				event->IsExecuted = 1;
 			}
 		}
 	}
@@ -6429,21 +6987,12 @@ void DLLExportClass::Glyphx_Queue_AI(void)
 	//------------------------------------------------------------------------
 	//	Clean out the DoList
 	//------------------------------------------------------------------------
-	while (DoList.Count) {
-
-		//.....................................................................
-		//	Discard events that have been executed, OR it's too late to execute.
-		//	(This happens if another player exits the game; he'll leave FRAMEINFO
-		//	events lying around in my queue.  They won't have been "executed",
-		//	because his IPX connection was destroyed.)
-		//.....................................................................
-		if ( (DoList.First().IsExecuted) || ((unsigned)Frame > DoList.First().Frame) ) {
-			DoList.Next();
-		}
-		else {
-			break;
-		}
-	}
+	//	Discard events that have been executed, OR it's too late to execute.
+	//	(This happens if another player exits the game; he'll leave FRAMEINFO
+	//	events lying around in my queue.  They won't have been "executed",
+	//	because his IPX connection was destroyed.)
+	//------------------------------------------------------------------------
+	DoList.Clean(Frame);
 
 }
 
@@ -8331,6 +8880,8 @@ bool DLLExportClass::Load(Straw & file)
 {
 	unsigned int version = 0;
 
+	Reset_Layer_Delta();
+
 	if (file.Get(&version, sizeof(version)) != sizeof(version)) {
 		return false;
 	}
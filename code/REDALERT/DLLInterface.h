@@ -73,7 +73,9 @@ enum GameStateRequestEnum {
 	GAME_STATE_PLACEMENT,
 	GAME_STATE_SHROUD,
 	GAME_STATE_OCCUPIER,
-	GAME_STATE_PLAYER_INFO
+	GAME_STATE_PLAYER_INFO,
+	GAME_STATE_LAYERS_DELTA,
+	GAME_STATE_SHROUD_PACKED
 };	
 
 
@@ -294,6 +296,41 @@ struct CNCObjectListStruct {
 
 
 
+/**************************************************************************************
+** 
+**  Object state deltas
+** 
+**  Changes to the GAME_STATE_LAYERS objects since the previous GAME_STATE_LAYERS_DELTA request.
+**  An entry is identified by its object pointer and the index of the draw within that object's
+**  draws. The added and changed objects come first, followed by the Count delta entries.
+*/
+enum CNCObjectDeltaEnum {
+	OBJECT_DELTA_ADDED,
+	OBJECT_DELTA_CHANGED,
+	OBJECT_DELTA_REMOVED,
+	OBJECT_DELTA_SORTED				// Only the sort order changed
+};
+
+struct CNCObjectDeltaStruct {
+	void				*CNCInternalObjectPointer;
+	unsigned short		DrawIndex;
+	unsigned char		Delta;
+	int					SortOrder;
+	int					ObjectIndex;		// Index into Objects when added or changed, -1 otherwise
+};
+
+struct CNCObjectDeltaListStruct {
+	unsigned int		Sequence;			// Number of this delta
+	unsigned int		BaseSequence;		// Delta this one applies on top of. 0 means start from an empty table
+	int					TotalCount;			// Entries in the table once this delta is applied
+	int					Count;				// Delta entries
+	int					ObjectCount;		// Objects added or changed
+	CNCObjectStruct	Objects[1];			// Variable length, followed by the delta entries
+};
+
+
+
+
 /**************************************************************************************
 ** 
 **  Placement validity data
@@ -860,6 +897,31 @@ struct CNCShroudStruct {
 };
 
 
+/**************************************************************************************
+** 
+**  Packed shroud data.
+** 
+**  The cells of GAME_STATE_SHROUD, in the same order, as three bit-planes of one bit
+**  per cell (cell N is bit N&31 of word N>>5): mapped, then visible, then jamming. The
+**  planes are followed by the shadow indices as runs of cells with the same index.
+** 
+*/
+struct CNCShroudRunStruct {
+	unsigned short				Count;
+	char							ShadowIndex;
+};
+
+struct CNCShroudPackedStruct {
+	int							CellX;
+	int							CellY;
+	int							CellWidth;
+	int							CellHeight;
+	int							PlaneWords;			// Words in each plane
+	int							RunCount;
+	unsigned int				Planes[1];			// Variable length. Three planes, then RunCount CNCShroudRunStruct
+};
+
+
 
 
 
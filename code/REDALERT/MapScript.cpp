@@ -3,6 +3,18 @@
 
 #include "FUNCTION.H"
 #include "MapScript.h"
+#include <imgui.h>
+
+/*
+** Names scripts use for the events, in ScriptEventType order
+*/
+static char const * const _event_names[MapScript::EVENT_COUNT] = {
+    "created",
+    "destroyed",
+    "captured",
+    "trigger",
+    "house"
+};
 
 /***********************************************************************************************
  * Script_GiveCredits - Gives a given player a given amount of credits                         *
@@ -72,27 +84,16 @@ static int Script_GiveCredits(lua_State* L) {
  *                                                                                             *
  *=============================================================================================*/
 static int Script_CountBuildings(lua_State* L) {
-    int structType = lua_tointeger(L, 1); 
-    
+    int structType = lua_tointeger(L, 1);
+
     int houseType = -1;
 
     // Optional houseType parameter
     if (lua_gettop(L) == 2) {
         houseType = lua_tointeger(L, 2);
     }
-    
-    int result = 0;
-    for (int b_index = 0; b_index < Buildings.Count(); b_index++) {
-        BuildingClass* building = Buildings.Ptr(b_index);
-
-        if (building->Owner() == houseType || houseType == -1) {
-            if (building->Class->Type == structType || structType == -1) {
-                result++;
-            }
-        }
-    }
 
-    lua_pushnumber(L, result);
+    lua_pushnumber(L, Scen.mapScript->Count(RTTI_BUILDING, structType, houseType));
     return 1;
 }
 
@@ -116,27 +117,16 @@ static int Script_CountBuildings(lua_State* L) {
  *                                                                                             *
  *=============================================================================================*/
 static int Script_CountAircraft(lua_State* L) {
-    int aircraftType = lua_tointeger(L, 1); 
-    
+    int aircraftType = lua_tointeger(L, 1);
+
     int houseType = -1;
 
     // Optional houseType parameter
     if (lua_gettop(L) == 2) {
         houseType = lua_tointeger(L, 2);
     }
-    
-    int result = 0;
-    for (int a_index = 0; a_index < Aircraft.Count(); a_index++) {
-        AircraftClass* aircraft = Aircraft.Ptr(a_index);
-
-        if (aircraft->Owner() == houseType || houseType == -1) {
-            if (aircraft->Class->Type == aircraftType || aircraftType == -1) {
-                result++;
-            }
-        }
-    }
 
-    lua_pushnumber(L, result);
+    lua_pushnumber(L, Scen.mapScript->Count(RTTI_AIRCRAFT, aircraftType, houseType));
     return 1;
 }
 
@@ -161,27 +151,16 @@ static int Script_CountAircraft(lua_State* L) {
  *                                                                                             *
  *=============================================================================================*/
 static int Script_CountUnits(lua_State* L) {
-    int unitType = lua_tointeger(L, 1); 
-    
+    int unitType = lua_tointeger(L, 1);
+
     int houseType = -1;
 
     // Optional houseType parameter
     if (lua_gettop(L) == 2) {
         houseType = lua_tointeger(L, 2);
     }
-    
-    int result = 0;
-    for (int u_index = 0; u_index < Units.Count(); u_index++) {
-        UnitClass* unit = Units.Ptr(u_index);
-
-        if (unit->Owner() == houseType || houseType == -1) {
-            if (unit->Class->Type == unitType || unitType == -1) {
-                result++;
-            }
-        }
-    }
 
-    lua_pushnumber(L, result);
+    lua_pushnumber(L, Scen.mapScript->Count(RTTI_UNIT, unitType, houseType));
     return 1;
 }
 
@@ -215,19 +194,8 @@ static int Script_CountInfantry(lua_State* L) {
     if (lua_gettop(L) == 2) {
         houseType = lua_tointeger(L, 2);
     }
-    
-    int result = 0;
-    for (int u_index = 0; u_index < Infantry.Count(); u_index++) {
-        InfantryClass* infantry = Infantry.Ptr(u_index);
-
-        if (infantry->Owner() == houseType || houseType == -1) {
-            if (infantry->Class->Type == infantryType || infantryType == -1) {
-                result++;
-            }
-        }
-    }
 
-    lua_pushnumber(L, result);
+    lua_pushnumber(L, Scen.mapScript->Count(RTTI_INFANTRY, infantryType, houseType));
     return 1;
 }
 
@@ -259,21 +227,10 @@ static int Script_CountVessels(lua_State* L) {
 
     // Optional houseType parameter
     if (lua_gettop(L) == 2) {
-        houseType = lua_tointeger(L, 2);        
-    }
-
-    int result = 0;
-    for (int u_index = 0; u_index < Vessels.Count(); u_index++) {
-        VesselClass* vessel = Vessels.Ptr(u_index);
-
-        if (vessel->Owner() == houseType || houseType == -1) {
-            if (vessel->Class->Type == vesselType || vesselType == -1) {
-                result++;
-            }
-        }
+        houseType = lua_tointeger(L, 2);
     }
 
-    lua_pushnumber(L, result);
+    lua_pushnumber(L, Scen.mapScript->Count(RTTI_VESSEL, vesselType, houseType));
     return 1;
 }
 
@@ -308,27 +265,74 @@ static int Script_SetTriggerCallback(lua_State* L) {
 
     // Optional actionIndex parameter
     if (lua_gettop(L) == 3) {
-        actionIndex = lua_tointeger(L, 2);
+        actionIndex = lua_tointeger(L, 3);
+    }
+
+    // Look the trigger type up once, then match triggers against it rather than by name
+    TriggerTypeClass* type = (triggerName != NULL) ? TriggerTypeClass::From_Name(triggerName) : NULL;
+    if (type == NULL || callbackName == NULL) {
+        return 1;
     }
 
+    // Resolve the callback now so that springing the trigger doesn't have to look it up
+    Scen.mapScript->Function_Ref(callbackName);
+
     // Find the trigger and set up callback
     for (int t_index = 0; t_index < Triggers.Count(); t_index++) {
         TriggerClass* trigger = Triggers.Ptr(t_index);
 
-        if (trigger != NULL) {
-            
-            if (strcmp(trigger->Name(), triggerName) == 0) {
+        if (trigger != NULL && trigger->Class == type) {
+            strncpy(trigger->MapScriptCallback,callbackName,sizeof(trigger->MapScriptCallback ) - 1);
+            trigger->MapScriptActionIndex = actionIndex;
+            break;
+        }
+    }
 
-                strncpy(trigger->MapScriptCallback,callbackName,sizeof(trigger->MapScriptCallback ) - 1);
-                trigger->MapScriptActionIndex = actionIndex;
+    return 1;
+}
 
-                break;
-            }
 
+/***********************************************************************************************
+ * Script_OnEvent - Subscribes a function to an event                                          *
+ *                                                                                             *
+ *   SCRIPT INPUT:	eventName (string)       - "created", "destroyed", "captured", "trigger"   *
+ *                                             or "house"                                      *
+ *                                                                                             *
+ *                	handler (function)       - Called once for every such event. It is given   *
+ *                                             (rtti, type, house, target) for "created" and   *
+ *                                             "destroyed", the same and the previous house    *
+ *                                             for "captured", (triggerName) for "trigger",    *
+ *                                             and (house, "units"/"buildings"/"all") for      *
+ *                                             "house" when a house loses the last of those    *
+ *                                                                                             *
+ *   SCRIPT OUTPUT:  result (boolean) - Was the handler subscribed?                            *
+ *                                                                                             *
+ * INPUT:  lua_State - The current Lua state                                                   *
+ *                                                                                             *
+ * OUTPUT:  int; Did the function run successfully? Return 1                                   *
+ *                                                                                             *
+ * WARNINGS:  Handlers are called at the start of the next logic frame, not as the event       *
+ *            happens.                                                                         *
+ *                                                                                             *
+ *=============================================================================================*/
+static int Script_OnEvent(lua_State* L) {
+    const char* eventName = luaL_checkstring(L, 1);
+    luaL_checktype(L, 2, LUA_TFUNCTION);
+
+    bool result = false;
+    for (int event = 0; event < MapScript::EVENT_COUNT; event++) {
+        if (stricmp(eventName, _event_names[event]) == 0) {
+            lua_pushvalue(L, 2);
+            int ref = luaL_ref(L, LUA_REGISTRYINDEX);
+            result = Scen.mapScript->Subscribe((MapScript::ScriptEventType)event, ref);
+            if (!result) {
+                luaL_unref(L, LUA_REGISTRYINDEX, ref);
+            }
+            break;
         }
-        
     }
 
+    lua_pushboolean(L, result);
     return 1;
 }
 
@@ -1029,6 +1033,56 @@ static int Script_SetBriefingText(lua_State* L) {
 }
 
 
+/***********************************************************************************************
+ * MapScript::MapScript - Constructor for a map script                                         *
+ *                                                                                             *
+ * INPUT:  none                                                                                *
+ *                                                                                             *
+ * OUTPUT:  none                                                                               *
+ *                                                                                             *
+ * WARNINGS:  none                                                                             *
+ *                                                                                             *
+ *=============================================================================================*/
+MapScript::MapScript(void) :
+    L(NULL),
+    EventCount(0),
+    FunctionCount(0),
+    FrameRef(LUA_NOREF),
+    FrameProfile(0),
+    TaskCount(0),
+    Budget(0),
+    IsInFrame(false),
+    IsFrameBusy(false),
+    ProfileCount(0),
+    Allocated(0),
+    Capturing(NULL),
+    CapturedFrom(HOUSE_NONE)
+{
+    memset(HandlerCount, 0, sizeof(HandlerCount));
+    Recount();
+}
+
+
+/***********************************************************************************************
+ * MapScript::~MapScript - Destructor for a map script                                         *
+ *                                                                                             *
+ *    Closing the Lua state releases every registry reference along with it.                   *
+ *                                                                                             *
+ * INPUT:  none                                                                                *
+ *                                                                                             *
+ * OUTPUT:  none                                                                               *
+ *                                                                                             *
+ * WARNINGS:  none                                                                             *
+ *                                                                                             *
+ *=============================================================================================*/
+MapScript::~MapScript(void) {
+    if (L != NULL) {
+        lua_close(L);
+        L = NULL;
+    }
+}
+
+
 /***********************************************************************************************
  * MapScript::CallFunction - Calls a given function within the current script                  *
  *                                                                                             *
@@ -1036,17 +1090,765 @@ static int Script_SetBriefingText(lua_State* L) {
  *                                                                                             *
  * OUTPUT:  void                                                                               *
  *                                                                                             *
- * WARNINGS:  ?                                                                                *
+ * WARNINGS:  Does nothing if the script has no such function. The function may not have       *
+ *            finished when this returns (see MapScript::Start).                               *
  *                                                                                             *
  *=============================================================================================*/
 void MapScript::CallFunction(const char* functionName) {
+    if (L == NULL) {
+        return;
+    }
 
-    lua_getglobal(L, functionName);
-    lua_pcall(L, 0, 0, 0);
-    
+    int profile = 0;
+    int ref = Function_Ref(functionName, &profile);
+    if (ref == LUA_NOREF) {
+        return;
+    }
+
+    // Outside of a frame the call gets a budget of its own
+    if (!IsInFrame) {
+        Budget = FRAME_BUDGET;
+    }
+
+    // Every coroutine slot is taken, so run it to the end instead
+    if (!Start(ref, profile, NULL)) {
+        lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+        Call(0);
+    }
 } //BriefingText
 
 
+/***********************************************************************************************
+ * MapScript::Function_Ref - Fetches the registry reference to a named script function         *
+ *                                                                                             *
+ *    The global is looked up the first time the name is asked for, and the reference (or      *
+ *    the lack of one) is remembered so that later calls do not look it up by name again.      *
+ *                                                                                             *
+ * INPUT:  functionName - The name of the global function                                      *
+ *                                                                                             *
+ *         profile      - Where to store the index of the function's profile (optional)        *
+ *                                                                                             *
+ * OUTPUT:  int; The reference, or LUA_NOREF if the script has no such function                *
+ *                                                                                             *
+ * WARNINGS:  A function the script defines or replaces after it was first asked for is not    *
+ *            seen.                                                                            *
+ *                                                                                             *
+ *=============================================================================================*/
+int MapScript::Function_Ref(const char* functionName, int* profile) {
+    if (L == NULL || functionName == NULL || *functionName == '\0') {
+        return LUA_NOREF;
+    }
+
+    for (int index = 0; index < FunctionCount; index++) {
+        if (strcmp(Functions[index].Name, functionName) == 0) {
+            if (profile != NULL) {
+                *profile = Functions[index].Profile;
+            }
+            return Functions[index].Ref;
+        }
+    }
+
+    if (FunctionCount >= MAX_FUNCTIONS || strlen(functionName) >= sizeof(Functions[0].Name)) {
+        return LUA_NOREF;
+    }
+
+    int ref = LUA_NOREF;
+    lua_getglobal(L, functionName);
+    if (lua_isfunction(L, -1)) {
+        ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    } else {
+        lua_pop(L, 1);
+    }
+
+    strcpy(Functions[FunctionCount].Name, functionName);
+    Functions[FunctionCount].Ref = ref;
+    Functions[FunctionCount].Profile = Profile_Of(functionName);
+    if (profile != NULL) {
+        *profile = Functions[FunctionCount].Profile;
+    }
+    FunctionCount++;
+    return ref;
+}
+
+
+/***********************************************************************************************
+ * MapScript::Subscribe - Adds a handler to an event                                           *
+ *                                                                                             *
+ * INPUT:  event - The event to subscribe to                                                   *
+ *                                                                                             *
+ *         ref   - Registry reference to the handler function                                  *
+ *                                                                                             *
+ * OUTPUT:  bool; Was there room for the handler?                                              *
+ *                                                                                             *
+ * WARNINGS:  none                                                                             *
+ *                                                                                             *
+ *=============================================================================================*/
+bool MapScript::Subscribe(ScriptEventType event, int ref) {
+    if ((unsigned)event >= EVENT_COUNT || HandlerCount[event] >= MAX_HANDLERS) {
+        return false;
+    }
+
+    // Profile the handler under the event and where the function is defined
+    char name[sizeof(Profiles[0].Name)];
+    lua_Debug ar;
+    lua_rawgeti(L, LUA_REGISTRYINDEX, ref);
+    if (lua_getinfo(L, ">S", &ar)) {
+        snprintf(name, sizeof(name), "%s %s:%d", _event_names[event], ar.short_src, ar.linedefined);
+    } else {
+        snprintf(name, sizeof(name), "%s #%d", _event_names[event], HandlerCount[event] + 1);
+    }
+
+    HandlerProfile[event][HandlerCount[event]] = Profile_Of(name);
+    Handlers[event][HandlerCount[event]++] = ref;
+    return true;
+}
+
+
+/***********************************************************************************************
+ * MapScript::Frame - Runs the script's callbacks for one logic frame                          *
+ *                                                                                             *
+ *    This routine is called once per logic frame. Callbacks suspended on an earlier frame     *
+ *    are resumed first, oldest first, then the handlers for the events queued since the       *
+ *    last frame are started, and then the script's map_frame function, if it has one. Once    *
+ *    the frame's budget is spent, whatever has not been started waits for the next frame.     *
+ *    Events raised by the handlers themselves are held over to the next frame.                *
+ *                                                                                             *
+ * INPUT:  none                                                                                *
+ *                                                                                             *
+ * OUTPUT:  void                                                                               *
+ *                                                                                             *
+ * WARNINGS:  map_frame is not started again while an earlier call of it is suspended.         *
+ *                                                                                             *
+ *=============================================================================================*/
+void MapScript::Frame(void) {
+    if (L == NULL) {
+        return;
+    }
+
+    IsInFrame = true;
+    Budget = FRAME_BUDGET;
+
+    int count = TaskCount;
+    for (int index = 0; index < count && Budget > 0; index++) {
+        if (Tasks[index].Thread != NULL) {
+            Resume(Tasks[index], 0);
+        }
+    }
+
+    count = EventCount;
+    int done = 0;
+    while (done < count && Budget > 0) {
+        QueuedEventType event = Events[done];
+        if (TaskCount + HandlerCount[event.Event] > MAX_TASKS) {
+            break;
+        }
+
+        done++;
+        for (int handler = 0; handler < HandlerCount[event.Event]; handler++) {
+            Start(Handlers[event.Event][handler], HandlerProfile[event.Event][handler], &event);
+        }
+    }
+
+    EventCount -= done;
+    if (EventCount > 0) {
+        memmove(&Events[0], &Events[done], EventCount * sizeof(Events[0]));
+    }
+
+    if (FrameRef != LUA_NOREF && !IsFrameBusy && Budget > 0) {
+        Start(FrameRef, FrameProfile, NULL, true);
+    }
+
+    Compact();
+    IsInFrame = false;
+}
+
+
+/***********************************************************************************************
+ * MapScript::Start - Starts a callback as a coroutine                                         *
+ *                                                                                             *
+ *    The callback runs until it returns, yields, or uses up what is left of the budget. If    *
+ *    it doesn't return it is left suspended, to be resumed by the next frame.                 *
+ *                                                                                             *
+ * INPUT:  ref     - Registry reference to the function                                        *
+ *                                                                                             *
+ *         profile - The profile to record its cost in                                         *
+ *                                                                                             *
+ *         event   - The event to pass to it, or NULL to pass nothing                          *
+ *                                                                                             *
+ *         frame   - Is this map_frame?                                                        *
+ *                                                                                             *
+ * OUTPUT:  bool; Was there a free coroutine slot to start it in?                              *
+ *                                                                                             *
+ * WARNINGS:  none                                                                             *
+ *                                                                                             *
+ *=============================================================================================*/
+bool MapScript::Start(int ref, int profile, QueuedEventType const * event, bool frame) {
+    if (TaskCount >= MAX_TASKS) {
+        return false;
+    }
+
+    int index = TaskCount++;
+    TaskType & task = Tasks[index];
+    task.Thread = lua_newthread(L);
+    task.Ref = luaL_ref(L, LUA_REGISTRYINDEX);
+    task.Profile = profile;
+    task.IsFrame = frame;
+
+    lua_sethook(task.Thread, Hook, LUA_MASKCOUNT, HOOK_STEP);
+    lua_rawgeti(task.Thread, LUA_REGISTRYINDEX, ref);
+    int args = (event != NULL) ? Push_Event(task.Thread, *event) : 0;
+
+    Profiles[profile].Calls++;
+    IsFrameBusy |= frame;
+    Resume(task, args);
+
+    // Give the slot straight back if it finished and nothing was started after it
+    if (task.Thread == NULL && index == TaskCount - 1) {
+        TaskCount--;
+    }
+    return true;
+}
+
+
+/***********************************************************************************************
+ * MapScript::Resume - Runs a callback's coroutine until it returns or is suspended            *
+ *                                                                                             *
+ *    The time taken and the memory allocated are added to the callback's profile, and the     *
+ *    time is also recorded under the script zone of the profiler.                             *
+ *                                                                                             *
+ * INPUT:  task - The callback                                                                 *
+ *                                                                                             *
+ *         args - The number of arguments on the coroutine's stack                             *
+ *                                                                                             *
+ * OUTPUT:  void                                                                               *
+ *                                                                                             *
+ * WARNINGS:  none                                                                             *
+ *                                                                                             *
+ *=============================================================================================*/
+void MapScript::Resume(TaskType & task, int args) {
+    ProfileType & profile = Profiles[task.Profile];
+    unsigned __int64 allocated = Allocated;
+    unsigned __int64 start = Benchmark::Clock();
+
+    BStart(BENCH_SCRIPT);
+    int result = lua_resume(task.Thread, L, args);
+    BEnd(BENCH_SCRIPT);
+
+    profile.Time += Benchmark::Clock() - start;
+    profile.Allocated += Allocated - allocated;
+    profile.Slices++;
+
+    if (result == LUA_YIELD) {
+        lua_pop(task.Thread, lua_gettop(task.Thread));
+        return;
+    }
+
+    if (result != LUA_OK) {
+        const char* error = lua_tostring(task.Thread, -1);
+        Console_Printf("MapScript: %s: %s\n", profile.Name, (error != NULL) ? error : "error");
+        profile.Errors++;
+    }
+
+    if (task.IsFrame) {
+        IsFrameBusy = false;
+    }
+    luaL_unref(L, LUA_REGISTRYINDEX, task.Ref);
+    task.Thread = NULL;
+}
+
+
+/***********************************************************************************************
+ * MapScript::Compact - Frees the coroutine slots of callbacks that have returned              *
+ *                                                                                             *
+ * INPUT:  none                                                                                *
+ *                                                                                             *
+ * OUTPUT:  void                                                                               *
+ *                                                                                             *
+ * WARNINGS:  The suspended callbacks keep their order.                                        *
+ *                                                                                             *
+ *=============================================================================================*/
+void MapScript::Compact(void) {
+    int count = 0;
+    for (int index = 0; index < TaskCount; index++) {
+        if (Tasks[index].Thread != NULL) {
+            Tasks[count++] = Tasks[index];
+        }
+    }
+    TaskCount = count;
+}
+
+
+/***********************************************************************************************
+ * MapScript::Hook - Count hook that suspends a callback once the budget is spent              *
+ *                                                                                             *
+ * INPUT:  L  - The coroutine running the callback                                             *
+ *                                                                                             *
+ *         ar - Unused                                                                         *
+ *                                                                                             *
+ * OUTPUT:  void                                                                               *
+ *                                                                                             *
+ * WARNINGS:  A callback can't be suspended from inside a C call that doesn't allow it (such   *
+ *            as a table.sort comparison); it then runs on until it can be.                    *
+ *                                                                                             *
+ *=============================================================================================*/
+void MapScript::Hook(lua_State* L, lua_Debug* ar) {
+    void* ud = NULL;
+    lua_getallocf(L, &ud);
+    MapScript* script = (MapScript*)ud;
+
+    script->Budget -= HOOK_STEP;
+    if (script->Budget <= 0 && lua_isyieldable(L)) {
+        lua_yield(L, 0);
+    }
+}
+
+
+/***********************************************************************************************
+ * MapScript::Alloc - Memory allocator for the Lua state that tallies what is allocated        *
+ *                                                                                             *
+ * INPUT:  ud    - The map script                                                              *
+ *                                                                                             *
+ *         ptr   - The block to resize or free, or NULL                                        *
+ *                                                                                             *
+ *         osize - Its current size                                                            *
+ *                                                                                             *
+ *         nsize - The size wanted, or 0 to free it                                            *
+ *                                                                                             *
+ * OUTPUT:  void*; The block, or NULL if it was freed or could not be allocated                *
+ *                                                                                             *
+ * WARNINGS:  none                                                                             *
+ *                                                                                             *
+ *=============================================================================================*/
+void* MapScript::Alloc(void* ud, void* ptr, size_t osize, size_t nsize) {
+    if (nsize == 0) {
+        free(ptr);
+        return NULL;
+    }
+
+    void* block = realloc(ptr, nsize);
+    if (block != NULL) {
+        size_t old = (ptr != NULL) ? osize : 0;
+        if (nsize > old) {
+            ((MapScript*)ud)->Allocated += nsize - old;
+        }
+    }
+    return block;
+}
+
+
+/***********************************************************************************************
+ * MapScript::Panic - Reports an error raised outside of any protected call                    *
+ *                                                                                             *
+ * INPUT:  L - The Lua state                                                                   *
+ *                                                                                             *
+ * OUTPUT:  int; 0, so that Lua aborts                                                         *
+ *                                                                                             *
+ * WARNINGS:  none                                                                             *
+ *                                                                                             *
+ *=============================================================================================*/
+int MapScript::Panic(lua_State* L) {
+    const char* error = lua_tostring(L, -1);
+    Console_Printf("MapScript: unprotected error: %s\n", (error != NULL) ? error : "error");
+    return 0;
+}
+
+
+/***********************************************************************************************
+ * MapScript::Profile_Of - Fetches the profile kept under a name, adding it if need be         *
+ *                                                                                             *
+ * INPUT:  name - The callback's name                                                          *
+ *                                                                                             *
+ * OUTPUT:  int; The profile's index (the last one is shared once they run out)                *
+ *                                                                                             *
+ * WARNINGS:  none                                                                             *
+ *                                                                                             *
+ *=============================================================================================*/
+int MapScript::Profile_Of(char const * name) {
+    for (int index = 0; index < ProfileCount; index++) {
+        if (strcmp(Profiles[index].Name, name) == 0) {
+            return index;
+        }
+    }
+
+    if (ProfileCount >= MAX_PROFILES) {
+        return MAX_PROFILES - 1;
+    }
+
+    ProfileType & profile = Profiles[ProfileCount];
+    memset(&profile, 0, sizeof(profile));
+    strncpy(profile.Name, name, sizeof(profile.Name) - 1);
+    return ProfileCount++;
+}
+
+
+/***********************************************************************************************
+ * MapScript::Render_Profile - Draws what each callback has cost in the profiler overlay       *
+ *                                                                                             *
+ * INPUT:  none                                                                                *
+ *                                                                                             *
+ * OUTPUT:  void                                                                               *
+ *                                                                                             *
+ * WARNINGS:  Call from ZoneProfilerClass::Render, inside its window.                          *
+ *                                                                                             *
+ *=============================================================================================*/
+void MapScript::Render_Profile(void) {
+    if (L == NULL || !ImGui::CollapsingHeader("Map Script", ImGuiTreeNodeFlags_DefaultOpen)) {
+        return;
+    }
+
+    int suspended = 0;
+    for (int index = 0; index < TaskCount; index++) {
+        if (Tasks[index].Thread != NULL) {
+            suspended++;
+        }
+    }
+    ImGui::Text("%d suspended, %d KB in use, %llu KB allocated", suspended, lua_gc(L, LUA_GCCOUNT, 0), Allocated / 1024);
+
+    for (int index = 0; index < ProfileCount; index++) {
+        ProfileType const & profile = Profiles[index];
+        if (profile.Calls == 0) {
+            continue;
+        }
+
+        double total = Benchmark::Seconds(profile.Time) * 1000.0;
+        ImGui::Text("%-32s %6lu calls %8.3f ms/call %6lu yields %8.1f KB %4lu errors",
+            profile.Name, profile.Calls, total / profile.Calls, profile.Slices - profile.Calls,
+            profile.Allocated / 1024.0, profile.Errors);
+    }
+}
+
+
+/***********************************************************************************************
+ * MapScript::Call - Calls the function on the stack and reports any script error              *
+ *                                                                                             *
+ * INPUT:  args - The number of arguments pushed after the function                            *
+ *                                                                                             *
+ * OUTPUT:  void                                                                               *
+ *                                                                                             *
+ * WARNINGS:  none                                                                             *
+ *                                                                                             *
+ *=============================================================================================*/
+void MapScript::Call(int args) {
+    if (lua_pcall(L, args, 0, 0) != LUA_OK) {
+        const char* error = lua_tostring(L, -1);
+        Console_Printf("MapScript: %s\n", (error != NULL) ? error : "error");
+        lua_pop(L, 1);
+    }
+}
+
+
+/***********************************************************************************************
+ * MapScript::Push_Event - Pushes the arguments a handler is given for an event                *
+ *                                                                                             *
+ * INPUT:  thread - The coroutine to push them onto                                            *
+ *                                                                                             *
+ *         event  - The queued event                                                           *
+ *                                                                                             *
+ * OUTPUT:  int; The number of arguments pushed                                                *
+ *                                                                                             *
+ * WARNINGS:  none                                                                             *
+ *                                                                                             *
+ *=============================================================================================*/
+int MapScript::Push_Event(lua_State* thread, QueuedEventType const & event) {
+    static char const * const _what[3] = {"units", "buildings", "all"};
+
+    switch (event.Event) {
+        case EVENT_TRIGGER:
+            lua_pushstring(thread, event.Name);
+            return 1;
+
+        case EVENT_HOUSE:
+            lua_pushinteger(thread, event.House);
+            lua_pushstring(thread, _what[event.Other]);
+            return 2;
+
+        default:
+            lua_pushinteger(thread, event.RTTI);
+            lua_pushinteger(thread, event.Type);
+            lua_pushinteger(thread, event.House);
+            lua_pushinteger(thread, event.Target);
+            if (event.Event == EVENT_CAPTURED) {
+                lua_pushinteger(thread, event.Other);
+                return 5;
+            }
+            return 4;
+    }
+}
+
+
+/***********************************************************************************************
+ * MapScript::Queue - Queues an event for delivery at the next frame                           *
+ *                                                                                             *
+ * INPUT:  event - The event to queue                                                          *
+ *                                                                                             *
+ * OUTPUT:  void                                                                               *
+ *                                                                                             *
+ * WARNINGS:  Events nobody subscribed to, and events past MAX_EVENTS in a frame, are dropped. *
+ *                                                                                             *
+ *=============================================================================================*/
+void MapScript::Queue(QueuedEventType const & event) {
+    if (HandlerCount[event.Event] == 0 || EventCount >= MAX_EVENTS) {
+        return;
+    }
+
+    Events[EventCount++] = event;
+}
+
+
+/***********************************************************************************************
+ * MapScript::Object_Tracked - Notes an object joining or leaving a house                      *
+ *                                                                                             *
+ *    Called by HouseClass::Tracking_Add and HouseClass::Tracking_Remove. Updates the house's  *
+ *    counts and queues the created, destroyed, captured and house events that follow.         *
+ *                                                                                             *
+ * INPUT:  techno - The object                                                                 *
+ *                                                                                             *
+ *         house  - The house it joins or leaves                                               *
+ *                                                                                             *
+ *         delta  - 1 if it joins the house, -1 if it leaves                                   *
+ *                                                                                             *
+ * OUTPUT:  void                                                                               *
+ *                                                                                             *
+ * WARNINGS:  none                                                                             *
+ *                                                                                             *
+ *=============================================================================================*/
+void MapScript::Object_Tracked(TechnoClass const * techno, HousesType house, int delta) {
+    RTTIType rtti = techno->What_Am_I();
+    int type = Type_Of(techno);
+    short* tally = Tally(rtti, house, type);
+    if (tally == NULL) {
+        return;
+    }
+
+    *tally += delta;
+    KindCount[house][rtti] += delta;
+
+    QueuedEventType event;
+    memset(&event, 0, sizeof(event));
+    event.RTTI = rtti;
+    event.House = house;
+    event.Type = type;
+    event.Target = techno->As_Target();
+
+    if (techno == Capturing) {
+        if (delta < 0) {
+            CapturedFrom = house;
+        } else {
+            event.Event = EVENT_CAPTURED;
+            event.Other = CapturedFrom;
+            Queue(event);
+            Capturing = NULL;
+        }
+    } else {
+        event.Event = (delta > 0) ? EVENT_CREATED : EVENT_DESTROYED;
+        Queue(event);
+    }
+
+    // Did the house just lose the last of its units or of its buildings?
+    if (delta < 0) {
+        int buildings = KindCount[house][RTTI_BUILDING];
+        int units = KindCount[house][RTTI_UNIT] + KindCount[house][RTTI_INFANTRY] + KindCount[house][RTTI_AIRCRAFT] + KindCount[house][RTTI_VESSEL];
+
+        if ((rtti == RTTI_BUILDING) ? (buildings == 0) : (units == 0)) {
+            event.Event = EVENT_HOUSE;
+            event.Other = (buildings == 0 && units == 0) ? 2 : (rtti == RTTI_BUILDING ? 1 : 0);
+            Queue(event);
+        }
+    }
+}
+
+
+/***********************************************************************************************
+ * MapScript::Trigger_Sprung - Queues the trigger event for a trigger that went off            *
+ *                                                                                             *
+ * INPUT:  name - The trigger's name                                                           *
+ *                                                                                             *
+ * OUTPUT:  void                                                                               *
+ *                                                                                             *
+ * WARNINGS:  none                                                                             *
+ *                                                                                             *
+ *=============================================================================================*/
+void MapScript::Trigger_Sprung(char const * name) {
+    QueuedEventType event;
+    memset(&event, 0, sizeof(event));
+    event.Event = EVENT_TRIGGER;
+    event.House = HOUSE_NONE;
+    strncpy(event.Name, name, sizeof(event.Name) - 1);
+    Queue(event);
+}
+
+
+/***********************************************************************************************
+ * MapScript::Count - Fetches the number of objects of a type that a house owns                *
+ *                                                                                             *
+ * INPUT:  rtti  - The kind of object (RTTI_BUILDING and so on)                                *
+ *                                                                                             *
+ *         type  - The type of object, or -1 for all of that kind                              *
+ *                                                                                             *
+ *         house - The house, or -1 for all houses                                             *
+ *                                                                                             *
+ * OUTPUT:  int; The number of matching objects                                                *
+ *                                                                                             *
+ * WARNINGS:  none                                                                             *
+ *                                                                                             *
+ *=============================================================================================*/
+int MapScript::Count(RTTIType rtti, int type, int house) const {
+    int first = (house == -1) ? HOUSE_FIRST : house;
+    int last = (house == -1) ? HOUSE_COUNT - 1 : house;
+
+    int result = 0;
+    for (int h_index = first; h_index <= last; h_index++) {
+        if (type == -1) {
+            if ((unsigned)h_index < HOUSE_COUNT && (unsigned)rtti < RTTI_COUNT) {
+                result += KindCount[h_index][rtti];
+            }
+        } else {
+            short const * tally = Tally(rtti, h_index, type);
+            if (tally != NULL) {
+                result += *tally;
+            }
+        }
+    }
+    return result;
+}
+
+
+/***********************************************************************************************
+ * MapScript::Recount - Counts every house's objects from the object heaps                     *
+ *                                                                                             *
+ *    Objects made before the script was loaded were never tracked, so the counts start out    *
+ *    from the heaps and are kept up from then on.                                             *
+ *                                                                                             *
+ * INPUT:  none                                                                                *
+ *                                                                                             *
+ * OUTPUT:  void                                                                               *
+ *                                                                                             *
+ * WARNINGS:  none                                                                             *
+ *                                                                                             *
+ *=============================================================================================*/
+void MapScript::Recount(void) {
+    memset(BuildingCount, 0, sizeof(BuildingCount));
+    memset(UnitCount, 0, sizeof(UnitCount));
+    memset(InfantryCount, 0, sizeof(InfantryCount));
+    memset(AircraftCount, 0, sizeof(AircraftCount));
+    memset(VesselCount, 0, sizeof(VesselCount));
+    memset(KindCount, 0, sizeof(KindCount));
+
+    for (int index = 0; index < Buildings.Count(); index++) {
+        Recount(Buildings.Ptr(index));
+    }
+    for (int index = 0; index < Units.Count(); index++) {
+        Recount(Units.Ptr(index));
+    }
+    for (int index = 0; index < Infantry.Count(); index++) {
+        Recount(Infantry.Ptr(index));
+    }
+    for (int index = 0; index < Aircraft.Count(); index++) {
+        Recount(Aircraft.Ptr(index));
+    }
+    for (int index = 0; index < Vessels.Count(); index++) {
+        Recount(Vessels.Ptr(index));
+    }
+}
+
+
+/***********************************************************************************************
+ * MapScript::Recount - Adds one object from the heaps to its house's counts                   *
+ *                                                                                             *
+ * INPUT:  techno - The object                                                                 *
+ *                                                                                             *
+ * OUTPUT:  void                                                                               *
+ *                                                                                             *
+ * WARNINGS:  none                                                                             *
+ *                                                                                             *
+ *=============================================================================================*/
+void MapScript::Recount(TechnoClass const * techno) {
+    if (techno == NULL || !techno->IsActive) {
+        return;
+    }
+
+    short* tally = Tally(techno->What_Am_I(), techno->Owner(), Type_Of(techno));
+    if (tally != NULL) {
+        (*tally)++;
+        KindCount[techno->Owner()][techno->What_Am_I()]++;
+    }
+}
+
+
+/***********************************************************************************************
+ * MapScript::Tally - Fetches the count kept for one type of object owned by one house         *
+ *                                                                                             *
+ * INPUT:  rtti  - The kind of object                                                          *
+ *                                                                                             *
+ *         house - The house                                                                   *
+ *                                                                                             *
+ *         type  - The type of object                                                          *
+ *                                                                                             *
+ * OUTPUT:  short*; The count, or NULL if no count is kept for that kind, house or type        *
+ *                                                                                             *
+ * WARNINGS:  none                                                                             *
+ *                                                                                             *
+ *=============================================================================================*/
+short* MapScript::Tally(RTTIType rtti, int house, int type) {
+    if ((unsigned)house >= HOUSE_COUNT || type < 0) {
+        return NULL;
+    }
+
+    switch (rtti) {
+        case RTTI_BUILDING:
+            return (type < STRUCT_COUNT) ? &BuildingCount[house][type] : NULL;
+
+        case RTTI_UNIT:
+            return (type < UNIT_COUNT) ? &UnitCount[house][type] : NULL;
+
+        case RTTI_INFANTRY:
+            return (type < INFANTRY_COUNT) ? &InfantryCount[house][type] : NULL;
+
+        case RTTI_AIRCRAFT:
+            return (type < AIRCRAFT_COUNT) ? &AircraftCount[house][type] : NULL;
+
+        case RTTI_VESSEL:
+            return (type < VESSEL_COUNT) ? &VesselCount[house][type] : NULL;
+
+        default:
+            return NULL;
+    }
+}
+
+
+/***********************************************************************************************
+ * MapScript::Type_Of - Fetches the type number of an object                                   *
+ *                                                                                             *
+ * INPUT:  techno - The object                                                                 *
+ *                                                                                             *
+ * OUTPUT:  int; Its StructType, UnitType and so on, or -1 if it is none of those              *
+ *                                                                                             *
+ * WARNINGS:  none                                                                             *
+ *                                                                                             *
+ *=============================================================================================*/
+int MapScript::Type_Of(TechnoClass const * techno) {
+    switch (techno->What_Am_I()) {
+        case RTTI_BUILDING:
+            return ((BuildingTypeClass const &)techno->Class_Of()).Type;
+
+        case RTTI_UNIT:
+            return ((UnitTypeClass const &)techno->Class_Of()).Type;
+
+        case RTTI_INFANTRY:
+            return ((InfantryTypeClass const &)techno->Class_Of()).Type;
+
+        case RTTI_AIRCRAFT:
+            return ((AircraftTypeClass const &)techno->Class_Of()).Type;
+
+        case RTTI_VESSEL:
+            return ((VesselTypeClass const &)techno->Class_Of()).Type;
+
+        default:
+            return -1;
+    }
+}
+
+
 /***********************************************************************************************
  * MapScript::setLuaPath - Sets Lua's path / extensions to search for scripts                  *
  *                                                                                             *
@@ -1098,12 +1900,17 @@ bool MapScript::Init(const char* mapName) {
 
     // Build map path
     sprintf(scriptName, "scripts/%s.script", mapName);
-    L = luaL_newstate();
+    L = lua_newstate(Alloc, this);
+    if (L == NULL) {
+        return false;
+    }
+    lua_atpanic(L, Panic);
 
     luaL_openlibs(L);
 
     // Load file
     if (luaL_loadfile(L, scriptName)){
+        lua_close(L);
         L = NULL;
         return false;
     }
@@ -1116,11 +1923,8 @@ bool MapScript::Init(const char* mapName) {
     // This allows require() to work
     SetLuaPath(";scripts/?.script;");
 
-    if (lua_pcall(L, 0, 0, 0)) {
-        L = NULL;
-        return false;
-    }
-
+    // The functions are registered before the script is run so that it can subscribe to
+    // events as it loads.
     /**********************************************************************************************
     * Red Alert Vanilla Actions                                                                   *
     *=============================================================================================*/
@@ -1204,6 +2008,7 @@ bool MapScript::Init(const char* mapName) {
     lua_register(L, "CountVessels", Script_CountVessels);	                        // Number of vessels of [type] for given [player]
 
     lua_register(L, "SetTriggerCallback", Script_SetTriggerCallback);	            // Initiates a given [callback] on an existing [trigger]
+    lua_register(L, "OnEvent", Script_OnEvent);	                                    // Calls [handler] whenever [event] happens
 
     
 /**********************************************************************************************
@@ -1213,6 +2018,16 @@ bool MapScript::Init(const char* mapName) {
     lua_pushnumber(L, PlayerPtr->ID);                                                // Local player (house) index
     lua_setglobal(L, "_localPlayer");
 
+    // Run the script
+    if (lua_pcall(L, 0, 0, 0)) {
+        lua_close(L);
+        L = NULL;
+        return false;
+    }
+
+    // Counts are kept from here on, and map_frame is only called if the script has one
+    Recount();
+    FrameRef = Function_Ref("map_frame", &FrameProfile);
 
     return true;
 }
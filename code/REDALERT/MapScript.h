@@ -14,12 +14,174 @@ extern "C" {
 //
 // MapScript
 //
+// Scripts are driven by events rather than by polling. A script subscribes a function to an
+// event with OnEvent(name, function); the function is held as a reference in the Lua registry
+// and is called once per logic frame for each event that was queued since the last frame.
+// Nothing is queued for events that have no subscribers, and nothing is called on a frame in
+// which no events happened unless the script defines map_frame.
+//
+// Every callback runs as a coroutine. The scripts together may run FRAME_BUDGET Lua
+// instructions per logic frame (checked every HOOK_STEP instructions); a callback that is
+// still running once the budget is spent is suspended and resumed on the next frame, as is one
+// that calls coroutine.yield() itself. The budget counts instructions rather than time so that
+// every machine in a multiplayer game suspends the scripts at the same points. The time each
+// callback takes and the memory it allocates are shown in the profiler overlay.
+//
+// The per-house object counts the Count* script functions return are kept up to date as
+// objects join and leave a house (see HouseClass::Tracking_Add) instead of being counted from
+// the object heaps on every call.
+//
 class MapScript {
 public:
+	typedef enum ScriptEventType {
+		EVENT_CREATED,				// object (rtti, type, house, target)
+		EVENT_DESTROYED,			// object (rtti, type, house, target)
+		EVENT_CAPTURED,				// object (rtti, type, house, target, previous house)
+		EVENT_TRIGGER,				// trigger (name)
+		EVENT_HOUSE,				// house (house, what) -- "units", "buildings" or "all" destroyed
+
+		EVENT_COUNT
+	} ScriptEventType;
+
+	enum {
+		MAX_HANDLERS = 16,			// Functions subscribed to any one event.
+		MAX_EVENTS = 256,			// Events queued per frame before more are thrown away.
+		MAX_FUNCTIONS = 32,			// Named functions whose references are cached.
+		MAX_TASKS = 32,				// Callbacks running or suspended at once.
+		MAX_PROFILES = 64,			// Callbacks whose run time is recorded.
+		HOOK_STEP = 1000,			// Instructions between budget checks.
+		FRAME_BUDGET = 100000		// Instructions all callbacks may run per logic frame.
+	};
+
+	MapScript(void);
+	~MapScript(void);
+
 	bool Init(const char* mapName);
 	void CallFunction(const char* functionName);
 	void SetLuaPath(const char* input_path);
+
+	void Frame(void);
+	bool Subscribe(ScriptEventType event, int ref);
+	int Function_Ref(const char* functionName, int* profile = NULL);
+
+	void Object_Tracked(TechnoClass const * techno, HousesType house, int delta);
+	void Object_Captured(TechnoClass const * techno) {Capturing = techno;}
+	void Trigger_Sprung(char const * name);
+
+	int Count(RTTIType rtti, int type, int house) const;
+	void Recount(void);
+
+	void Render_Profile(void);
+
 private:
+	/*
+	**	One queued event. Objects are described by value since they may be gone by the time
+	**	the event is delivered.
+	*/
+	typedef struct {
+		char Event;
+		char RTTI;
+		char House;
+		char Other;
+		short Type;
+		long Target;
+		char Name[24];
+	} QueuedEventType;
+
+	/*
+	**	A script function looked up by name, such as a trigger callback.
+	*/
+	typedef struct {
+		char Name[32];
+		int Ref;
+		int Profile;
+	} FunctionType;
+
+	/*
+	**	A callback running as a coroutine. The thread is held by a registry reference until
+	**	the callback returns.
+	*/
+	typedef struct {
+		lua_State* Thread;
+		int Ref;
+		int Profile;
+		bool IsFrame;				// This is map_frame.
+	} TaskType;
+
+	/*
+	**	What one callback has cost since the script was loaded.
+	*/
+	typedef struct {
+		char Name[48];
+		unsigned long Calls;
+		unsigned long Slices;		// Times resumed, counting the first.
+		unsigned long Errors;
+		unsigned __int64 Time;		// Clock ticks spent running it.
+		unsigned __int64 Allocated;	// Bytes it allocated.
+	} ProfileType;
+
+	void Call(int args);
+	bool Start(int ref, int profile, QueuedEventType const * event, bool frame = false);
+	void Resume(TaskType & task, int args);
+	void Compact(void);
+	int Profile_Of(char const * name);
+	int Push_Event(lua_State* thread, QueuedEventType const & event);
+	void Queue(QueuedEventType const & event);
+	void Recount(TechnoClass const * techno);
+	short * Tally(RTTIType rtti, int house, int type);
+	short const * Tally(RTTIType rtti, int house, int type) const {return(((MapScript *)this)->Tally(rtti, house, type));}
+
+	static int Type_Of(TechnoClass const * techno);
+
+	static void Hook(lua_State* L, lua_Debug* ar);
+	static void* Alloc(void* ud, void* ptr, size_t osize, size_t nsize);
+	static int Panic(lua_State* L);
+
 	lua_State* L;
+
+	int Handlers[EVENT_COUNT][MAX_HANDLERS];
+	int HandlerProfile[EVENT_COUNT][MAX_HANDLERS];
+	int HandlerCount[EVENT_COUNT];
+
+	QueuedEventType Events[MAX_EVENTS];
+	int EventCount;
+
+	FunctionType Functions[MAX_FUNCTIONS];
+	int FunctionCount;
+	int FrameRef;
+	int FrameProfile;
+
+	TaskType Tasks[MAX_TASKS];
+	int TaskCount;
+
+	/*
+	**	Instructions left in this frame's budget, and whether a frame is being run (callbacks
+	**	started outside of a frame, such as trigger callbacks, get a budget of their own).
+	*/
+	long Budget;
+	bool IsInFrame;
+	bool IsFrameBusy;				// map_frame is suspended.
+
+	ProfileType Profiles[MAX_PROFILES];
+	int ProfileCount;
+	unsigned __int64 Allocated;		// Bytes the Lua state has allocated in all.
+
+	/*
+	**	The object whose ownership is being moved by a capture and the house it is being taken
+	**	from. The move is reported as one EVENT_CAPTURED rather than as a destroy and a create.
+	*/
+	TechnoClass const * Capturing;
+	HousesType CapturedFrom;
+
+	/*
+	**	Objects of each type owned by each house, and objects of each kind (indexed by
+	**	RTTIType) owned by each house.
+	*/
+	short BuildingCount[HOUSE_COUNT][STRUCT_COUNT];
+	short UnitCount[HOUSE_COUNT][UNIT_COUNT];
+	short InfantryCount[HOUSE_COUNT][INFANTRY_COUNT];
+	short AircraftCount[HOUSE_COUNT][AIRCRAFT_COUNT];
+	short VesselCount[HOUSE_COUNT][VESSEL_COUNT];
+	short KindCount[HOUSE_COUNT][RTTI_COUNT];
 };
-#endif
\ No newline at end of file
+#endif
@@ -3448,6 +3448,7 @@ extern "C" long __cdecl Buffer_To_Page(int x, int y, int w, int h, void *buffer,
 		dst += pitch * 4;
 	}
 
+	vp.Mark_Dirty(xstart, ystart, blit_width, yend - ystart + 1);
 	return 0;
 }
 